@@ -26,3 +26,10 @@ string FlowId::get_fivetuple_str() const {
        << "#" << dest_port;
     return sstm.str();
 }
+
+string FlowId::get_reverse_fivetuple_str() const {
+    stringstream sstm;
+    sstm << dest_ip << "#" << source_ip << "#" << proto << "#" << dest_port
+       << "#" << source_port;
+    return sstm.str();
+}
@@ -18,6 +18,9 @@ public:
     FlowId(FlowId const& flow_id_to_copy);
 
     std::string get_fivetuple_str() const;
+
+    // Return the fivetuple string of the flow in the opposite direction
+    std::string get_reverse_fivetuple_str() const;
 };
 
 #endif // NETSEC_FLOWID_H_
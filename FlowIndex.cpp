@@ -0,0 +1,142 @@
+#include "FlowIndex.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+static const uint64_t FLOW_INDEX_MAGIC = 0x3130584449574c46ULL; // "FLWIDX01"
+
+// Map the whole file at path read-only, and return its address and size.
+// Empty files are not mapped, and NULL is returned for them.
+static const char *map_file(const string& path, size_t *size) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw FlowIndexException("Cannot open " + path);
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        throw FlowIndexException("Cannot stat " + path);
+    }
+    *size = st.st_size;
+    if (*size == 0) {
+        close(fd);
+        return NULL;
+    }
+    void *addr = mmap(NULL, *size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        throw FlowIndexException("Cannot mmap " + path);
+    }
+    return (const char *)addr;
+}
+
+void FlowIndexWriter::write(const string& path) const {
+    vector<unsigned long> flow_ids;
+    flow_ids.reserve(_offsets.size());
+    for (auto it = _offsets.begin(); it != _offsets.end(); ++it) {
+        flow_ids.push_back(it->first);
+    }
+    sort(flow_ids.begin(), flow_ids.end());
+
+    ofstream out(path, ios::binary);
+    if (!out) {
+        throw FlowIndexException("Cannot open " + path + " for writing");
+    }
+    const uint64_t header[3] = {FLOW_INDEX_MAGIC, flow_ids.size(), _num_offsets};
+    out.write((const char *)header, sizeof(header));
+    uint64_t first = 0;
+    for (auto it = flow_ids.begin(); it != flow_ids.end(); ++it) {
+        const uint64_t count = _offsets.at(*it).size();
+        const uint64_t entry[3] = {*it, first, count};
+        out.write((const char *)entry, sizeof(entry));
+        first += count;
+    }
+    for (auto it = flow_ids.begin(); it != flow_ids.end(); ++it) {
+        const vector<uint64_t>& offsets = _offsets.at(*it);
+        out.write((const char *)offsets.data(),
+                  offsets.size() * sizeof(uint64_t));
+    }
+    if (!out) {
+        throw FlowIndexException("Error while writing " + path);
+    }
+}
+
+FlowIndexReader::FlowIndexReader(const string& packets_path,
+                                 const string& index_path) {
+    _index = map_file(index_path, &_index_size);
+    const uint64_t *header = (const uint64_t *)_index;
+    if (_index_size < 3 * sizeof(uint64_t) || header[0] != FLOW_INDEX_MAGIC) {
+        unmap();
+        throw FlowIndexException(index_path + " is not a flow index");
+    }
+    _num_flows = header[1];
+    const uint64_t num_offsets = header[2];
+    // Check the size in words, written so that it cannot overflow
+    const uint64_t body_words = _index_size / sizeof(uint64_t) - 3;
+    if (_index_size % sizeof(uint64_t) != 0 || _num_flows > body_words / 3
+            || num_offsets != body_words - 3 * _num_flows) {
+        unmap();
+        throw FlowIndexException(index_path + " is truncated or corrupted");
+    }
+    _entries = (const Entry *)(header + 3);
+    _offsets = (const uint64_t *)(_entries + _num_flows);
+    // Every entry must point within the offsets, and the entries must be
+    // sorted by flow id for the binary search in get_flow_packets
+    for (uint64_t i = 0; i < _num_flows; ++i) {
+        const Entry& entry = _entries[i];
+        if (entry.count > num_offsets
+                || entry.first > num_offsets - entry.count
+                || (i > 0 && _entries[i - 1].flow_id >= entry.flow_id)) {
+            unmap();
+            throw FlowIndexException(index_path + " is truncated or corrupted");
+        }
+    }
+    try {
+        _packets = map_file(packets_path, &_packets_size);
+    } catch (...) {
+        unmap();
+        throw;
+    }
+}
+
+FlowIndexReader::~FlowIndexReader() {
+    unmap();
+}
+
+void FlowIndexReader::unmap() {
+    if (_index != NULL) munmap((void *)_index, _index_size);
+    if (_packets != NULL) munmap((void *)_packets, _packets_size);
+    _index = _packets = NULL;
+}
+
+vector<string> FlowIndexReader::get_flow_packets(unsigned long flow_id) const {
+    vector<string> records;
+    const Entry *end = _entries + _num_flows;
+    const Entry *entry = lower_bound(_entries, end, flow_id,
+            [](const Entry& e, unsigned long id) { return e.flow_id < id; });
+    if (entry == end || entry->flow_id != flow_id) return records;
+
+    records.reserve(entry->count);
+    for (uint64_t i = entry->first; i < entry->first + entry->count; ++i) {
+        const uint64_t offset = _offsets[i];
+        if (offset >= _packets_size) {
+            throw FlowIndexException("Record offset beyond end of file");
+        }
+        const char *start = _packets + offset;
+        const char *eol = (const char *)memchr(start, '\n',
+                                               _packets_size - offset);
+        records.emplace_back(start, eol != NULL ? eol : _packets + _packets_size);
+    }
+    return records;
+}
+
+string flow_index_path(const string& packets_path) {
+    return packets_path + ".flow_index";
+}
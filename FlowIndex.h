@@ -0,0 +1,93 @@
+#ifndef NETSEC_FLOWINDEX_H_
+#define NETSEC_FLOWINDEX_H_
+
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/* The flow index is a binary sidecar of a packet output file, which maps each
+ * flow id to the byte offsets of the records of its packets in that file, so
+ * that all packets of a flow can be fetched without scanning the whole file.
+ *
+ * File layout (all fields are uint64_t in host byte order):
+ *   header:  magic, number of flows, number of offsets
+ *   entries: one (flow id, position of first offset, offset count) triple per
+ *            flow, sorted by flow id
+ *   offsets: the record offsets of all flows, grouped by flow and in order
+ */
+
+// FlowIndexWriter collects the record offsets of the packets of each flow,
+// and writes them out as an index file once the packet output is complete.
+class FlowIndexWriter {
+    std::unordered_map<unsigned long, std::vector<uint64_t> > _offsets;
+    uint64_t _num_offsets = 0;
+
+public:
+    // Record that the packet record at offset belongs to flow flow_id
+    void add(unsigned long flow_id, uint64_t offset) {
+        _offsets[flow_id].push_back(offset);
+        _num_offsets++;
+    }
+
+    // Write the index to the file at path
+    void write(const std::string& path) const;
+
+    // Forget all offsets collected so far
+    void clear() {
+        _offsets.clear();
+        _num_offsets = 0;
+    }
+};
+
+// FlowIndexReader memory-maps a packet output file together with its index,
+// and gives random access to the packet records of single flows.
+class FlowIndexReader {
+    struct Entry {
+        uint64_t flow_id;
+        uint64_t first;
+        uint64_t count;
+    };
+
+    const char *_packets = nullptr;
+    size_t _packets_size = 0;
+    const char *_index = nullptr;
+    size_t _index_size = 0;
+    const Entry *_entries = nullptr;
+    uint64_t _num_flows = 0;
+    const uint64_t *_offsets = nullptr;
+
+    // Unmap the packet output file and the index
+    void unmap();
+
+public:
+    // Map the packet output file at packets_path and the index at index_path
+    FlowIndexReader(const std::string& packets_path,
+                    const std::string& index_path);
+    FlowIndexReader(const FlowIndexReader&) = delete;
+    FlowIndexReader& operator=(const FlowIndexReader&) = delete;
+    ~FlowIndexReader();
+
+    // Return the number of flows in the index
+    uint64_t get_num_flows() const {
+        return _num_flows;
+    }
+
+    // Return the packet records (lines, without the trailing newline) of the
+    // given flow, or an empty vector if the flow is not in the index
+    std::vector<std::string> get_flow_packets(unsigned long flow_id) const;
+};
+
+// Return the path of the index file for the packet output file at
+// packets_path
+std::string flow_index_path(const std::string& packets_path);
+
+// Exception thrown when an index file cannot be written, read or parsed
+class FlowIndexException : public std::runtime_error {
+public:
+    FlowIndexException(const std::string& message)
+        : std::runtime_error(message) {};
+};
+
+#endif // NETSEC_FLOWINDEX_H_
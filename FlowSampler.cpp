@@ -0,0 +1,49 @@
+#include "FlowSampler.h"
+
+#include <utility>
+#include <arpa/inet.h>
+
+#include "constants.h"
+
+using namespace std;
+
+FlowSampler::FlowSampler(unsigned int flow_rate, unsigned int packet_rate,
+                         unsigned int seed)
+        : _flow_rate(flow_rate), _packet_rate(packet_rate), _rng(seed),
+          _packet_dist(0, packet_rate > 1 ? packet_rate - 1 : 0) {}
+
+// Finalizer of MurmurHash3, mixes all bits of the input into the output
+static inline uint64_t mix64(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+uint64_t FlowSampler::flow_hash(uint32_t source_ip, uint32_t dest_ip,
+                                uint16_t source_port, uint16_t dest_port,
+                                uint8_t proto) {
+    // Bring the addresses to host byte order, so the hash does not depend on
+    // the endianness of the machine, and order the two (address, port)
+    // endpoints, so that both directions of a connection hash the same
+    uint64_t low = (uint64_t(ntohl(source_ip)) << 16) | source_port;
+    uint64_t high = (uint64_t(ntohl(dest_ip)) << 16) | dest_port;
+    if (low > high) std::swap(low, high);
+    return mix64(mix64(mix64(low) ^ high) ^ proto);
+}
+
+std::ostream& FlowSampler::print_scaling(std::ostream &strm) const {
+    const char * sep = NSConstants::FIELD_SEPARATOR;
+    strm << "flow_sampling_rate" << sep << _flow_rate << endl;
+    strm << "packet_sampling_rate" << sep << _packet_rate << endl;
+    // Under packet sampling the flows whose packets were all dropped are not
+    // seen at all, so no unbiased scaling of the flow count can be given
+    if (_packet_rate <= 1) {
+        strm << "flow_scaling" << sep << get_flow_scaling() << endl;
+    }
+    strm << "packet_scaling" << sep << get_packet_scaling() << endl;
+    strm << "byte_scaling" << sep << get_packet_scaling() << endl;
+    return strm;
+}
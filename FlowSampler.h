@@ -0,0 +1,65 @@
+#ifndef NETSEC_FLOWSAMPLER_H_
+#define NETSEC_FLOWSAMPLER_H_
+
+#include <cstdint>
+#include <ostream>
+#include <random>
+
+/* FlowSampler decides which packets are processed when only a sample of the
+ * traffic is wanted. Two kinds of sampling can be combined:
+ * - flow sampling keeps 1 in flow_rate flows, chosen through a stable hash of
+ *   the five-tuple, so that either all or none of the packets of a flow are
+ *   kept, and the same flows are chosen in every run. The hash is symmetric,
+ *   so the flows of the two directions of a connection are kept or dropped
+ *   together (which TCP state tracking relies on);
+ * - packet sampling keeps each packet (of the sampled flows) independently
+ *   with probability 1/packet_rate.
+ * Counts measured on the sample are turned into unbiased estimates of the
+ * counts of the whole traffic by multiplying them by the scaling factors.
+ */
+class FlowSampler {
+    const unsigned int _flow_rate;
+    const unsigned int _packet_rate;
+    std::minstd_rand _rng;
+    std::uniform_int_distribution<unsigned int> _packet_dist;
+
+public:
+    // A rate of 1 disables the corresponding kind of sampling
+    FlowSampler(unsigned int flow_rate, unsigned int packet_rate,
+                unsigned int seed=1);
+
+    // Return whether a packet of the given five-tuple (addresses in network
+    // byte order, ports in host byte order) is in the sample
+    bool keep_packet(uint32_t source_ip, uint32_t dest_ip, uint16_t source_port,
+                     uint16_t dest_port, uint8_t proto) {
+        if (_flow_rate > 1 and flow_hash(source_ip, dest_ip, source_port,
+                                         dest_port, proto) % _flow_rate != 0) {
+            return false;
+        }
+        return _packet_rate <= 1 or _packet_dist(_rng) == 0;
+    }
+
+    // Stable 64-bit hash of a five-tuple (independent of platform, run and
+    // direction), with addresses in network byte order and ports in host byte
+    // order
+    static uint64_t flow_hash(uint32_t source_ip, uint32_t dest_ip,
+                              uint16_t source_port, uint16_t dest_port,
+                              uint8_t proto);
+
+    // Scaling factor for the number of flows (only unbiased without packet
+    // sampling)
+    double get_flow_scaling() const {
+        return _flow_rate;
+    }
+
+    // Scaling factor for the packet and byte counts of a sampled flow
+    double get_packet_scaling() const {
+        return _packet_rate;
+    }
+
+    // Print the sampling rates and scaling factors, one per line. The flow
+    // scaling is left out under packet sampling, where it would be biased.
+    std::ostream& print_scaling(std::ostream &strm) const;
+};
+
+#endif // NETSEC_FLOWSAMPLER_H_
@@ -1,12 +1,12 @@
 #include "FlowStats.h"
 
 #include <iostream>
+#include <netinet/tcp.h>
 #include <boost/array.hpp>
 #include <boost/accumulators/accumulators.hpp>
 #include <boost/accumulators/statistics.hpp>
 
 #include "constants.h"
-#include "utils.h"
 
 using namespace std;
 using namespace boost::accumulators;
@@ -16,33 +16,54 @@ typedef accumulator_set<double, stats<tag::min, tag::max, tag::mean,
         tag::median, tag::variance> > stats_acc_t;
 typedef accumulator_set<double, stats<tag::extended_p_square> > quantile_acc_t;
 
+#ifdef NETSEC_TCP_STATE_TRACKING
+// Convert the flags of a TCP header to the TcpState bits they signal
+static inline uint8_t tcp_state_from_flags(uint8_t tcp_flags) {
+    uint8_t state = 0;
+    if (tcp_flags & TH_SYN) {
+        state |= (tcp_flags & TH_ACK) ? FlowStats::TCP_SYN_ACK
+                                      : FlowStats::TCP_SYN;
+    }
+    if (tcp_flags & TH_FIN) state |= FlowStats::TCP_FIN;
+    if (tcp_flags & TH_RST) state |= FlowStats::TCP_RST;
+    return state;
+}
+#endif
+
 FlowStats::FlowStats(unsigned long id, FlowId const& flow_id,
-                     struct timeval first_ts, unsigned long first_bytes)
+                     ns_time_t first_ts, unsigned long first_bytes,
+                     uint8_t tcp_flags)
         : _id(id), _flow_id(flow_id), _first_ts(first_ts), _last_ts(first_ts),
           _pkt_count(1), _total_bytes(first_bytes)
 #ifdef NETSEC_ADVANCED_FLOW_STATS
         , _pkt_count_per_second (NSConstants::MaxFlowLifetime, 0),
-          _total_bytes_per_second (NSConstants::MaxFlowLifetime, 0) {
+          _total_bytes_per_second (NSConstants::MaxFlowLifetime, 0)
+#endif
+{
+#ifdef NETSEC_ADVANCED_FLOW_STATS
     _pkt_count_per_second.at(0) += 1;
     _total_bytes_per_second.at(0) += first_bytes;
-}
-#else
-{}
 #endif
+#ifdef NETSEC_TCP_STATE_TRACKING
+    _tcp_state = tcp_state_from_flags(tcp_flags);
+#endif
+}
 
-bool FlowStats::is_expired(const struct timeval *at_time) const {
-    struct timeval time_diff_from_first;
-    struct timeval time_diff_from_last;
+bool FlowStats::is_expired(const ns_time_t *at_time) const {
     if (_expired_flag) return true;
     if (at_time == NULL) at_time = &_last_ts;
-    timeval_sub(&_first_ts, at_time, &time_diff_from_first);
-    timeval_sub(&_last_ts, at_time, &time_diff_from_last);
-    return (time_diff_from_first.tv_sec >= NSConstants::MaxFlowLifetime)
-           || (time_diff_from_last.tv_sec >= NSConstants::MaxFlowInactiveTime);
+    return (*at_time - _last_ts >= NSConstants::MaxFlowInactiveTimeNs)
+           || (*at_time - _first_ts >= NSConstants::MaxFlowLifetimeNs)
+#ifdef NETSEC_TCP_STATE_TRACKING
+           // Closed connections only linger for late packets (e.g., last ACK)
+           || (is_tcp_closed() and
+               *at_time - _last_ts >= NSConstants::TcpClosedLingerTimeNs)
+#endif
+           ;
 }
 
-float FlowStats::get_flow_duration() const {
-    return timeval_to_seconds(&_last_ts) - timeval_to_seconds(&_first_ts);
+double FlowStats::get_flow_duration() const {
+    return ns_time_to_seconds(_last_ts - _first_ts);
 }
 
 void FlowStats::mark_as_expired() {
@@ -58,20 +79,22 @@ void FlowStats::mark_as_expired() {
     _expired_flag = true;
 }
 
-void FlowStats::register_packet(const struct timeval *ts,
-                                unsigned long num_bytes) {
+void FlowStats::register_packet(ns_time_t ts, unsigned long num_bytes,
+                                uint8_t tcp_flags) {
     if (_expired_flag) {
         throw FlowExpiredException("Cannot register packet on expired flow");
     }
-    _last_ts = *ts;
+    _last_ts = ts;
     _pkt_count += 1;
     _total_bytes += num_bytes;
-    // Increase packet count and byte count for the current second
-    struct timeval time_diff;
-    timeval_sub(&_first_ts, ts, &time_diff);
 #ifdef NETSEC_ADVANCED_FLOW_STATS
-    _pkt_count_per_second.at(time_diff.tv_sec) += 1;
-    _total_bytes_per_second.at(time_diff.tv_sec) += num_bytes;
+    // Increase packet count and byte count for the current second
+    const ns_time_t second = (ts - _first_ts) / NS_PER_SEC;
+    _pkt_count_per_second.at(second) += 1;
+    _total_bytes_per_second.at(second) += num_bytes;
+#endif
+#ifdef NETSEC_TCP_STATE_TRACKING
+    _tcp_state |= tcp_state_from_flags(tcp_flags);
 #endif
 }
 
@@ -109,6 +132,14 @@ std::ostream& operator<<(std::ostream &strm, const FlowStats &fs) {
     for (int i=0; i < probs.size(); ++i) {
         strm << extended_p_square(byte_quantile_acc)[i] << sep;
     }
+#endif
+#ifdef NETSEC_TCP_STATE_TRACKING
+    // Print handshake and close flags (1 if seen in this direction)
+    strm << bool(fs._tcp_state & FlowStats::TCP_SYN) << sep;
+    strm << bool(fs._tcp_state & FlowStats::TCP_SYN_ACK) << sep;
+    strm << bool(fs._tcp_state & FlowStats::TCP_FIN) << sep;
+    strm << bool(fs._tcp_state & FlowStats::TCP_RST) << sep;
+    strm << fs.is_tcp_closed() << sep;
 #endif
     return strm;
 }
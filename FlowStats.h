@@ -1,6 +1,7 @@
 #ifndef NETSEC_FLOWSTATS_H_
 #define NETSEC_FLOWSTATS_H_
 
+#include <cstdint>
 #include <ctime>
 #include <ostream>
 #include <stdexcept>
@@ -8,14 +9,15 @@
 #include <vector>
 
 #include "FlowId.h"
+#include "utils.h"
 
 /* FlowStats contains the main statistics of a flow */
 class FlowStats {
     friend std::ostream& operator<<(std::ostream &, const FlowStats &);
     const unsigned long _id;
     const FlowId _flow_id;
-    const struct timeval _first_ts; // Timestamp of the first packet
-    struct timeval _last_ts; // Timestamp of the last packet
+    const ns_time_t _first_ts; // Timestamp of the first packet
+    ns_time_t _last_ts; // Timestamp of the last packet
     // Indicates whether the flow has been marked as expired and cleaned up
     bool _expired_flag = false;
     unsigned long _pkt_count; // Total number of packet seen for this flow
@@ -24,14 +26,33 @@ class FlowStats {
     std::vector<unsigned int> _pkt_count_per_second;
     std::vector<unsigned long> _total_bytes_per_second;
 #endif
+#ifdef NETSEC_TCP_STATE_TRACKING
+    // TCP state (TcpState bits) seen in the packets of this flow, and in the
+    // packets of the flow in the reverse direction (as notified by the table)
+    uint8_t _tcp_state = 0;
+    uint8_t _peer_tcp_state = 0;
+    // Whether the flow of the reverse direction has been seen at all
+    bool _tcp_peer_seen = false;
+#endif
 
 public:
-    // Fast constructor that takes the information about the first packet
-    FlowStats(unsigned long id, FlowId const& flow_id, struct timeval first_ts,
-              unsigned long first_bytes);
+    // Bits of the TCP state of a flow, i.e., of the TCP connection events seen
+    // in one direction
+    enum TcpState : uint8_t {
+        TCP_SYN = 1, // SYN without ACK (connection opening)
+        TCP_SYN_ACK = 2, // SYN with ACK (connection accepted)
+        TCP_FIN = 4,
+        TCP_RST = 8
+    };
+
+    // Fast constructor that takes the information about the first packet.
+    // tcp_flags are the flags of the TCP header (0 for other protocols).
+    FlowStats(unsigned long id, FlowId const& flow_id, ns_time_t first_ts,
+              unsigned long first_bytes, uint8_t tcp_flags=0);
 
-    // Check if a flow is expired at the time provided
-    bool is_expired(const struct timeval *at_time=NULL) const;
+    // Check if a flow is expired at the time provided (or at the time of its
+    // last packet, if no time is provided)
+    bool is_expired(const ns_time_t *at_time=NULL) const;
 
     // Return the id of the flow
     unsigned long get_id() const {
@@ -43,14 +64,43 @@ public:
         return _flow_id;
     }
 
+    // Return the timestamp of the last packet of the flow
+    ns_time_t get_last_ts() const {
+        return _last_ts;
+    }
+
     // Return the duration of the flow (so far) in seconds
-    float get_flow_duration () const;
+    double get_flow_duration () const;
 
     // Mark the flow as expired (do cleanup if necessary)
     void mark_as_expired ();
 
     // Count a packet for the statistics of this flow
-    void register_packet(const struct timeval *ts, unsigned long num_bytes);
+    void register_packet(ns_time_t ts, unsigned long num_bytes,
+                         uint8_t tcp_flags=0);
+
+#ifdef NETSEC_TCP_STATE_TRACKING
+    // Return the TCP state (TcpState bits) seen in this direction
+    uint8_t get_tcp_state() const {
+        return _tcp_state;
+    }
+
+    // Record the TCP state seen in the flow of the reverse direction
+    void register_peer_tcp_state(uint8_t peer_tcp_state) {
+        _peer_tcp_state |= peer_tcp_state;
+        _tcp_peer_seen = true;
+    }
+
+    // Check if the TCP connection of the flow has been closed, either by a
+    // RST, or by a FIN in both directions. When the reverse direction has
+    // never been seen (e.g., in single direction traces such as the CAIDA
+    // ones), a FIN in this direction is enough.
+    bool is_tcp_closed() const {
+        return ((_tcp_state | _peer_tcp_state) & TCP_RST)
+               || ((_tcp_state & _peer_tcp_state) & TCP_FIN)
+               || (!_tcp_peer_seen && (_tcp_state & TCP_FIN));
+    }
+#endif
 };
 
 std::ostream& operator<<(std::ostream &, const FlowStats &);
@@ -4,8 +4,9 @@
 #include <memory> // For std::shared_ptr
 #include <utility> // For std::move
 #include <cassert>
+#include <netinet/tcp.h>
 
-#include "utils.h"
+#include "constants.h"
 
 using namespace std;
 
@@ -14,49 +15,121 @@ typedef map<string,shared_ptr<FlowStats> >::iterator map_it_type;
 FlowStatsTable::FlowStatsTable() {}
 
 unsigned long FlowStatsTable::register_new_packet(const FlowId& flow_id,
-                                                  const struct timeval *ts,
-                                                  unsigned long num_bytes) {
+                                                  ns_time_t ts,
+                                                  unsigned long num_bytes,
+                                                  uint8_t tcp_flags) {
     pair<map_it_type,bool> emplace_result;
     const string fivetuple = flow_id.get_fivetuple_str();
+#ifdef NETSEC_TCP_STATE_TRACKING
+    bool was_closed = false; // Whether the flow was closed before this packet
+#endif
 
     auto flow_stat = _table.find(fivetuple);
     if (flow_stat == _table.end()) {// The packet belongs to a new flow
         shared_ptr<FlowStats> flow_stats_ptr(
-                new FlowStats(_id_counter, flow_id, *ts, num_bytes));
+                new FlowStats(_id_counter, flow_id, ts, num_bytes, tcp_flags));
         emplace_result = _table.emplace(fivetuple, flow_stats_ptr);
         assert (emplace_result.second); // The key must be newly inserted
         flow_stat = emplace_result.first; // Get iterator at new element
         _id_counter++; // Increase the flow id counter
-    } else if (flow_stat->second->is_expired(ts)) {
+    } else if (flow_stat->second->is_expired(&ts)
+#ifdef NETSEC_TCP_STATE_TRACKING
+               // A new connection (SYN without ACK) on the five-tuple of a
+               // closed one starts a new flow, even if the old one lingers
+               or (flow_stat->second->is_tcp_closed()
+                   and (tcp_flags & (TH_SYN | TH_ACK)) == TH_SYN)
+#endif
+               ) {
         flow_stat->second->mark_as_expired();
         _expired_flows.push_back(flow_stat->second);
         _table.erase(flow_stat);
         // Recursive call after the expired flow has been removed.
         // Could be made more efficient by repeating the code above, or by
         // doing some additional checks.
-        return register_new_packet(flow_id, ts, num_bytes);
+        return register_new_packet(flow_id, ts, num_bytes, tcp_flags);
     } else {
-       flow_stat->second->register_packet(ts, num_bytes);
+#ifdef NETSEC_TCP_STATE_TRACKING
+       was_closed = flow_stat->second->is_tcp_closed();
+#endif
+       flow_stat->second->register_packet(ts, num_bytes, tcp_flags);
     }
+    const unsigned long id = flow_stat->second->get_id();
+
+#ifdef NETSEC_TCP_STATE_TRACKING
+    if (tcp_flags & (TH_FIN | TH_RST)) {
+        update_tcp_close(flow_stat, was_closed);
+    }
+    expire_closed_flows(ts);
+#endif
 
     // Keep track of the most recent timestamp
-    if (timeval_to_seconds(ts) > timeval_to_seconds(&_last_change_ts)) {
-        _last_change_ts = *ts;
+    if (ts > _last_change_ts) {
+        _last_change_ts = ts;
     }
     _changed_after_last_expiration = true;
-    return flow_stat->second->get_id();
+    return id;
+}
+
+#ifdef NETSEC_TCP_STATE_TRACKING
+void FlowStatsTable::update_tcp_close(map_it_type flow_stat,
+                                      bool was_closed) {
+    auto reverse = _table.find(
+            flow_stat->second->get_flow_id().get_reverse_fivetuple_str());
+    if (reverse != _table.end()) {
+        const bool reverse_was_closed = reverse->second->is_tcp_closed();
+        reverse->second->register_peer_tcp_state(
+                flow_stat->second->get_tcp_state());
+        flow_stat->second->register_peer_tcp_state(
+                reverse->second->get_tcp_state());
+        if (!reverse_was_closed and reverse->second->is_tcp_closed()) {
+            _closed_flows.push_back({reverse->first, reverse->second,
+                                     reverse->second->get_last_ts()});
+        }
+    }
+    if (!was_closed and flow_stat->second->is_tcp_closed()) {
+        _closed_flows.push_back({flow_stat->first, flow_stat->second,
+                                 flow_stat->second->get_last_ts()});
+    }
+}
+
+void FlowStatsTable::expire_closed_flows(ns_time_t at_time) {
+    while (!_closed_flows.empty()) {
+        ClosedFlow& closed = _closed_flows.front();
+        if (at_time - closed.last_ts < NSConstants::TcpClosedLingerTimeNs) {
+            break;
+        }
+        if (closed.flow->get_last_ts() != closed.last_ts) {
+            // The flow got packets after being queued: requeue it according
+            // to its last activity, so that it does not hold back the others
+            const ns_time_t last_ts = closed.flow->get_last_ts();
+            ClosedFlow requeued = {std::move(closed.key),
+                                   std::move(closed.flow), last_ts};
+            _closed_flows.pop_front();
+            _closed_flows.push_back(std::move(requeued));
+            continue;
+        }
+        // Only remove the flow if it is still the one in the table, and has
+        // not already been expired in some other way
+        auto flow_stat = _table.find(closed.key);
+        if (flow_stat != _table.end() and flow_stat->second == closed.flow) {
+            flow_stat->second->mark_as_expired();
+            _expired_flows.push_back(flow_stat->second);
+            _table.erase(flow_stat);
+        }
+        _closed_flows.pop_front();
+    }
 }
+#endif
 
 void FlowStatsTable::erase_expired_flows() {
     _expired_flows.clear();
 }
 
-int FlowStatsTable::collect_expired_flows(const struct timeval *at_time) {
+int FlowStatsTable::collect_expired_flows(const ns_time_t *at_time) {
     if (at_time == NULL and !_changed_after_last_expiration) {
         return _expired_flows.size();
     }
-    if (at_time == NULL and
-            !(_last_change_ts.tv_sec == 0 and _last_change_ts.tv_usec == 0)) {
+    if (at_time == NULL and _last_change_ts != 0) {
         at_time = &_last_change_ts;
     }
     for (auto it = _table.begin(); it != _table.end(); /*in-code*/) {
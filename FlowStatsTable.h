@@ -1,7 +1,9 @@
 #ifndef NETSEC_FLOWSTATS_TABLE_H_
 #define NETSEC_FLOWSTATS_TABLE_H_
 
+#include <cstdint>
 #include <ctime>
+#include <deque>
 #include <map>
 #include <memory>
 #include <ostream>
@@ -9,6 +11,7 @@
 
 #include "FlowStats.h"
 #include "FlowId.h"
+#include "utils.h"
 
 // FlowStatsTable keeps track of flow statistics: it registers new packets,
 // considering them for the stats of the flow those packets belong to, and it
@@ -17,34 +20,65 @@ class FlowStatsTable {
     // Underlying map containing the flow stats for all flows.
     // Flows are identified through a string containing the flow's fivetuple.
     std::map<std::string,std::shared_ptr<FlowStats> > _table;
-    struct timeval _last_change_ts = {0, 0};
+    ns_time_t _last_change_ts = 0;
     std::vector<std::shared_ptr<FlowStats> > _expired_flows;
     // Counter to incrementally generate the flow ids
     unsigned long _id_counter = 0;
     // Flag which indicates whether any new packet/flow has been considered
     // after the last time collect_expired_flows was called
     bool _changed_after_last_expiration = false;
+#ifdef NETSEC_TCP_STATE_TRACKING
+    // A flow whose TCP connection has been closed, with its key in _table and
+    // the timestamp of its last packet when it was (re)queued
+    struct ClosedFlow {
+        std::string key;
+        std::shared_ptr<FlowStats> flow;
+        ns_time_t last_ts;
+    };
+    // Flows whose TCP connection has been closed, roughly in order of last
+    // activity. They are expired as soon as they have been inactive for
+    // NSConstants::TcpClosedLingerTimeNs.
+    std::deque<ClosedFlow> _closed_flows;
+
+    // Exchange the TCP state of the flow and of the flow in the reverse
+    // direction, and queue them if their connection has just been closed.
+    // was_closed tells whether the flow was closed before its last packet.
+    void update_tcp_close(
+        std::map<std::string,std::shared_ptr<FlowStats> >::iterator flow_stat,
+        bool was_closed);
+
+    // Expire the closed flows that have been lingering long enough
+    void expire_closed_flows(ns_time_t at_time);
+#endif
 
 public:
     FlowStatsTable();
 
-    const struct timeval& get_last_change_ts() {
+    ns_time_t get_last_change_ts() {
         return _last_change_ts;
     }
 
     // Add a new packet to the statistics of the flow it belongs to.
+    // tcp_flags are the flags of the TCP header (0 for other protocols).
     // Returns the id of the flow of the packet.
     unsigned long register_new_packet(const FlowId& flow_id,
-                                      const struct timeval *ts,
-                                      unsigned long num_bytes);
+                                      ns_time_t ts,
+                                      unsigned long num_bytes,
+                                      uint8_t tcp_flags=0);
     // Clean up all expired flows
     void erase_expired_flows();
 
     // Check all flows to find the expired ones, and return the number of all
     // currently expired flows.
-    // If a pointer to a timeval is provided in at_time, this will be used
+    // If a pointer to a timestamp is provided in at_time, this will be used
     // as current time to determine whether a flow is expired or not.
-    int collect_expired_flows(const struct timeval *at_time=NULL);
+    int collect_expired_flows(const ns_time_t *at_time=NULL);
+
+    // Return the number of flows expired so far and not yet erased, without
+    // checking for new expired flows
+    size_t get_num_expired_flows() const {
+        return _expired_flows.size();
+    }
 
     std::ostream& print_expired_flows(std::ostream &strm);
 
@@ -10,6 +10,16 @@ namespace NSConstants {
     // Max time of inactivity, in seconds, before a flow is expired
     const int MaxFlowInactiveTime = 60;
     const char * const FIELD_SEPARATOR = "\t";
+    // The same limits in nanoseconds, to be compared directly with timestamps
+    const long long MaxFlowLifetimeNs = MaxFlowLifetime * 1000000000LL;
+    const long long MaxFlowInactiveTimeNs = MaxFlowInactiveTime * 1000000000LL;
+    // Time of inactivity, in nanoseconds, after which a TCP flow whose
+    // connection has been closed is expired (only used with TCP state
+    // tracking)
+    const long long TcpClosedLingerTimeNs = 2 * 1000000000LL;
+    // Number of expired flows after which their stats are written out (and
+    // the flows freed) while still processing a file
+    const unsigned int ExpiredFlowsFlushThreshold = 10000;
 }
 
 #endif
@@ -6,7 +6,9 @@
 
 #include <string>
 #include <iostream>
+#include <cstdint>
 #include <cstdio>
+#include <cstdlib>
 #include <unistd.h>
 #include <sstream>
 #include <fstream>
@@ -21,8 +23,11 @@
 #include <arpa/inet.h>
 #include <boost/filesystem.hpp>
 
+#include "FlowIndex.h"
+#include "FlowSampler.h"
 #include "FlowStatsTable.h"
 #include "FlowId.h"
+#include "constants.h"
 #include "utils.h"
 
 using namespace std;
@@ -32,7 +37,19 @@ using namespace boost::filesystem;
 // In particular, a pointer to such a struct is passed as the userData param.
 struct packetHandler_args {
     FlowStatsTable *flow_table;
+    // Output for the packet list, or NULL if no packet list is written
     ostream *packet_out;
+    // Nanoseconds per unit of the sub-second part of the pcap timestamps
+    // (1000 for microsecond captures, 1 for nanosecond captures)
+    ns_time_t subsec_to_ns;
+    // Index of the packet output, or NULL if no index is written
+    FlowIndexWriter *flow_index;
+    // Number of bytes written so far to packet_out
+    uint64_t packet_out_offset;
+    // Sampler choosing the packets to process, or NULL to process all
+    FlowSampler *sampler;
+    // Output for the stats of the flows expired while processing the file
+    ostream *stats_out;
 };
 
 // This function handles a single packet, and is used by the pcap_loop function
@@ -43,10 +60,27 @@ void packetHandler(u_char *userData, const struct pcap_pkthdr* pkthdr,
 //string create_fivetuple_id(const char *sourceIp, const char *destIp,
 //                           int ipProto, u_int sourcePort, u_int destPort);
 
-void output_packet_description(ostream &out, unsigned long flowid,
-                               char *sourceIp, char *destIp,
-                               int ipProto, u_int sourcePort, u_int destPort,
-                               const struct pcap_pkthdr* pkthdr);
+// Writes the description of a packet to out, returning the number of bytes
+// written
+size_t output_packet_description(ostream &out, unsigned long flowid,
+                                 char *sourceIp, char *destIp,
+                                 int ipProto, u_int sourcePort, u_int destPort,
+                                 const struct pcap_pkthdr* pkthdr, ns_time_t ts);
+
+// Opens a pcap or pcap-ng file for offline processing, asking libpcap for
+// nanosecond timestamps when it supports them. On success, subsec_to_ns is
+// set to the number of nanoseconds per unit of the pkthdr->ts.tv_usec field.
+pcap_t *open_offline_nano(const char *fname, ns_time_t *subsec_to_ns,
+                          char *errbuf);
+
+// Compiles the BPF filter expression and installs it on descr, so that packets
+// not matching it are dropped by libpcap before packetHandler is called.
+// Returns false (after printing an error) if the expression is invalid.
+bool set_bpf_filter(pcap_t *descr, const char *filter_expr);
+
+// Parses a sampling rate given on the command line. Returns 0 if the rate is
+// not a positive integer.
+unsigned int parse_sampling_rate(const char *str);
 
 // main: processes the pcap files provided as command line arguments,
 // and extrapolates the flows and statistics about them.
@@ -56,23 +90,69 @@ int main(int argc, char *argv[]) {
     ofstream packet_out, statFile;
     time_t curr_time;
     FlowStatsTable flow_table;
-    struct packetHandler_args pkthandler_args = {&flow_table, &cout};
+    FlowIndexWriter flow_index;
+    struct packetHandler_args pkthandler_args = {&flow_table, NULL, 1000,
+                                                 NULL, 0, NULL, NULL};
+    bool write_packets = false, write_index = false, bad_usage = false;
+    const char *filter_expr = NULL;
+    unsigned int flow_sampling_rate = 1, packet_sampling_rate = 1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "f:pxs:S:")) != -1) {
+        switch (opt) {
+        case 'f':
+            filter_expr = optarg;
+            break;
+        case 's':
+            flow_sampling_rate = parse_sampling_rate(optarg);
+            bad_usage |= flow_sampling_rate == 0;
+            break;
+        case 'S':
+            packet_sampling_rate = parse_sampling_rate(optarg);
+            bad_usage |= packet_sampling_rate == 0;
+            break;
+        case 'x':
+            write_index = true;
+            // fall through, the index requires the packet output
+        case 'p':
+            write_packets = true;
+            break;
+        default:
+            bad_usage = true;
+        }
+    }
+
+    if (bad_usage or optind >= argc) {
+        cerr << "Usage: " << argv[0] << " [-f filter] [-s N] [-S M] [-p] [-x]"
+             << " pcap_file..." << endl
+             << "  -f  only process packets matching the BPF filter expression"
+             << endl
+             << "  -s  only process 1 in N flows, chosen by a hash of the"
+             << " five-tuple" << endl
+             << "  -S  only process each packet with probability 1/M" << endl
+             << "  -p  write the list of packets with their flow ids" << endl
+             << "  -x  as -p, and also write a flow id index of the list"
+             << endl;
+        return 1;
+    }
+
+    FlowSampler sampler(flow_sampling_rate, packet_sampling_rate);
+    const bool sampling = flow_sampling_rate > 1 or packet_sampling_rate > 1;
+    if (sampling) {
+        pkthandler_args.sampler = &sampler;
+    }
+
     path packet_output_dir (absolute("data_output/packets"));
     path flow_stats_output_dir (absolute("data_output/flow_stats"));
     create_directories(packet_output_dir);
     create_directories(flow_stats_output_dir);
 
-    if (argc < 2) {
-        cerr << "Usage: " << argv[0] << " pcap_file..." << endl;
-        return 1;
-    }
-
     // Set failing bits for all fstream's
     // (by default one would have to check manually if if the fstream has failed)
     packet_out.exceptions(ofstream::failbit | ofstream::badbit);
     statFile.exceptions(ofstream::failbit | ofstream::badbit);
 
-    for (int i=1; i<argc; i++) {
+    for (int i=optind; i<argc; i++) {
         path in_file (argv[i]);
         time(&curr_time);
         if (!is_regular_file(in_file)) {
@@ -81,22 +161,40 @@ int main(int argc, char *argv[]) {
             continue;
         }
 
-        cout << ctime(&curr_time) << " Processing file " << i << ": "
-             << in_file << endl;
+        cout << ctime(&curr_time) << " Processing file " << i - optind + 1
+             << ": " << in_file << endl;
 
-        // open capture file for offline processing
-        descr = pcap_open_offline(in_file.string().c_str(), errbuf);
+        // open capture file (pcap or pcap-ng) for offline processing
+        descr = open_offline_nano(in_file.string().c_str(),
+                                  &pkthandler_args.subsec_to_ns, errbuf);
         if (descr == NULL) {
             cerr << ctime(&curr_time) << "pcap_open_offline() failed on file "
                  << in_file << ": " << errbuf << endl;
             return 1;
         }
+        if (filter_expr != NULL and !set_bpf_filter(descr, filter_expr)) {
+            pcap_close(descr);
+            return 1;
+        }
 
         // get new output file for packet list output
         path packet_output_file (packet_output_dir /
             in_file.stem().replace_extension(".processed_pcap"));
-        packet_out.open(packet_output_file.string());
-        pkthandler_args.packet_out = &packet_out;
+        if (write_packets) {
+            packet_out.open(packet_output_file.string());
+            pkthandler_args.packet_out = &packet_out;
+            pkthandler_args.packet_out_offset = 0;
+        }
+        if (write_index) {
+            pkthandler_args.flow_index = &flow_index;
+        }
+
+        // get new output file for the stats of expired flows, which is
+        // already written to while processing the packets
+        path flow_stats_output_file (flow_stats_output_dir /
+            in_file.stem().replace_extension(".expired_flows"));
+        statFile.open(flow_stats_output_file.string());
+        pkthandler_args.stats_out = &statFile;
 
         // Start packet processing loop, just like live capture.
         // For each packet, packetHandler is called to process it
@@ -106,16 +204,23 @@ int main(int argc, char *argv[]) {
             return 1;
         }
         pcap_close(descr);
-        packet_out.close();
+        if (write_packets) {
+            packet_out.close();
+        }
+        if (write_index) {
+            try {
+                flow_index.write(flow_index_path(packet_output_file.string()));
+            } catch (const FlowIndexException& e) {
+                cerr << ctime(&curr_time) << "Writing the flow index of file "
+                     << in_file << " failed: " << e.what() << endl;
+                return 1;
+            }
+            flow_index.clear();
+        }
 
         time(&curr_time);
         cout << ctime(&curr_time) << " Storing stats of expired flows" << endl;
 
-        // get new output file for the stats of expired flows
-        path flow_stats_output_file (flow_stats_output_dir /
-            in_file.stem().replace_extension(".expired_flows"));
-        statFile.open(flow_stats_output_file.string());
-
         // Check expired flows, write their stats to file, and delete the
         // entries
         if (flow_table.collect_expired_flows() > 0) {
@@ -123,6 +228,15 @@ int main(int argc, char *argv[]) {
             flow_table.erase_expired_flows();
         }
         statFile.close();
+
+        // Store the scaling factors of the estimates alongside the stats
+        if (sampling) {
+            path sampling_output_file (flow_stats_output_dir /
+                in_file.stem().replace_extension(".sampling"));
+            statFile.open(sampling_output_file.string());
+            sampler.print_scaling(statFile);
+            statFile.close();
+        }
     }
 
     return 0;
@@ -137,19 +251,20 @@ void packetHandler(u_char *userData, const struct pcap_pkthdr* pkthdr,
     char sourceIp[INET_ADDRSTRLEN];
     char destIp[INET_ADDRSTRLEN];
     u_int sourcePort = 0, destPort = 0;
+    uint8_t tcpFlags = 0;
     //string fivetuple;
     unsigned long current_flow_id;
     struct packetHandler_args* args = (struct packetHandler_args *)userData;
 
     ipHeader = (struct ip*)packet;
-    inet_ntop(AF_INET, &(ipHeader->ip_src), sourceIp, INET_ADDRSTRLEN);
-    inet_ntop(AF_INET, &(ipHeader->ip_dst), destIp, INET_ADDRSTRLEN);
 
-    // Retrieve source and destination port for TCP or UDP protocol
+    // Retrieve source and destination port for TCP or UDP protocol, and drop
+    // any other packet before doing more work on it
     if (ipHeader->ip_p == IPPROTO_TCP) {
         tcpHeader = (tcphdr*)(packet + sizeof(struct ip));
         sourcePort = ntohs(tcpHeader->source);
         destPort = ntohs(tcpHeader->dest);
+        tcpFlags = tcpHeader->th_flags;
     } else if (ipHeader->ip_p == IPPROTO_UDP) {
         udpHeader = (udphdr*)(packet + sizeof(struct ip));
         sourcePort = ntohs(udpHeader->source);
@@ -158,18 +273,45 @@ void packetHandler(u_char *userData, const struct pcap_pkthdr* pkthdr,
         return;
     }
 
+    // Drop packets outside of the sample before any flow table access
+    if (args->sampler != NULL and !args->sampler->keep_packet(
+            ipHeader->ip_src.s_addr, ipHeader->ip_dst.s_addr,
+            sourcePort, destPort, ipHeader->ip_p)) {
+        return;
+    }
+
+    inet_ntop(AF_INET, &(ipHeader->ip_src), sourceIp, INET_ADDRSTRLEN);
+    inet_ntop(AF_INET, &(ipHeader->ip_dst), destIp, INET_ADDRSTRLEN);
+
     //fivetuple = create_fivetuple_id(sourceIp, destIp, (int)ipHeader->ip_p,
     //                              sourcePort, destPort);
 
     FlowId flow_id(sourceIp, destIp, sourcePort, destPort, (int)ipHeader->ip_p);
 
+    const ns_time_t ts = to_ns_time(pkthdr->ts.tv_sec, pkthdr->ts.tv_usec,
+                                    args->subsec_to_ns);
+
     current_flow_id = args->flow_table->register_new_packet(
-            flow_id, &pkthdr->ts, pkthdr->len);
+            flow_id, ts, pkthdr->len, tcpFlags);
+
+    // Write out and free the flows expired so far, instead of keeping them in
+    // memory until the end of the file
+    if (args->flow_table->get_num_expired_flows()
+            >= NSConstants::ExpiredFlowsFlushThreshold) {
+        args->flow_table->print_expired_flows(*(args->stats_out));
+        args->flow_table->erase_expired_flows();
+    }
 
     // Print out the packet description together with the ID of the flow it
-    // belongs to.
-//    output_packet_description(*(args->packet_out), current_flow_id, sourceIp,
-//            destIp, (int)ipHeader->ip_p, sourcePort, destPort, pkthdr);
+    // belongs to, and record where it was written in the index.
+    if (args->packet_out != NULL) {
+        if (args->flow_index != NULL) {
+            args->flow_index->add(current_flow_id, args->packet_out_offset);
+        }
+        args->packet_out_offset += output_packet_description(
+                *(args->packet_out), current_flow_id, sourceIp, destIp,
+                (int)ipHeader->ip_p, sourcePort, destPort, pkthdr, ts);
+    }
 
 }
 
@@ -186,14 +328,63 @@ void packetHandler(u_char *userData, const struct pcap_pkthdr* pkthdr,
 /* This function prints out the packet description of the given packet together
  * with the flow ID. The function gets as input the entire packet header, so it
  * can be changed to print out more information if required.
+ * The timestamp is printed as seconds and nanoseconds.
+ * The record is formatted in a buffer first, so that its exact length is known
+ * for the flow index.
  */
-void output_packet_description(ostream &out, unsigned long flowid,
-                               char *sourceIp, char *destIp,
-                               int ipProto, u_int sourcePort, u_int destPort,
-                               const struct pcap_pkthdr* pkthdr) {
-    out << flowid << "\t" << sourceIp << "\t" << destIp << "\t"
-      << ipProto << "\t" << sourcePort << "\t" << destPort << "\t>\t";
-
-    out << pkthdr->len << "\t" << pkthdr->ts.tv_sec << "\t" << pkthdr->ts.tv_usec << endl;
+size_t output_packet_description(ostream &out, unsigned long flowid,
+                                 char *sourceIp, char *destIp,
+                                 int ipProto, u_int sourcePort, u_int destPort,
+                                 const struct pcap_pkthdr* pkthdr, ns_time_t ts) {
+    char record[160];
+    int len = snprintf(record, sizeof(record),
+            "%lu\t%s\t%s\t%d\t%u\t%u\t>\t%u\t%lld\t%lld\n",
+            flowid, sourceIp, destIp, ipProto, sourcePort, destPort,
+            pkthdr->len, (long long)(ts / NS_PER_SEC),
+            (long long)(ts % NS_PER_SEC));
+    out.write(record, len);
+    return len;
 }
 
+
+pcap_t *open_offline_nano(const char *fname, ns_time_t *subsec_to_ns,
+                          char *errbuf) {
+#ifdef PCAP_TSTAMP_PRECISION_NANO
+    // libpcap >= 1.5 scales the timestamps of both pcap and pcap-ng files to
+    // the requested precision, so that tv_usec actually holds nanoseconds.
+    *subsec_to_ns = 1;
+    return pcap_open_offline_with_tstamp_precision(
+            fname, PCAP_TSTAMP_PRECISION_NANO, errbuf);
+#else
+    *subsec_to_ns = 1000;
+    return pcap_open_offline(fname, errbuf);
+#endif
+}
+
+
+bool set_bpf_filter(pcap_t *descr, const char *filter_expr) {
+    struct bpf_program filter;
+    // Offline captures carry no netmask, which only matters for filters on
+    // IPv4 broadcast addresses
+    if (pcap_compile(descr, &filter, filter_expr, 1,
+                     PCAP_NETMASK_UNKNOWN) < 0) {
+        cerr << "pcap_compile() failed on filter \"" << filter_expr << "\": "
+             << pcap_geterr(descr) << endl;
+        return false;
+    }
+    int result = pcap_setfilter(descr, &filter);
+    pcap_freecode(&filter);
+    if (result < 0) {
+        cerr << "pcap_setfilter() failed: " << pcap_geterr(descr) << endl;
+        return false;
+    }
+    return true;
+}
+
+
+unsigned int parse_sampling_rate(const char *str) {
+    char *end;
+    unsigned long rate = strtoul(str, &end, 10);
+    if (*str == '\0' || *end != '\0' || rate > UINT32_MAX) return 0;
+    return rate;
+}
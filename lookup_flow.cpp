@@ -0,0 +1,45 @@
+/*
+ * Prints the packet records of the given flows, as written by get_flow_stats
+ * to a packet output file, using the flow index written alongside it
+ * (get_flow_stats -x) instead of scanning the whole file.
+ */
+
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "FlowIndex.h"
+
+using namespace std;
+
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        cerr << "Usage: " << argv[0] << " packet_output_file flow_id..."
+             << endl;
+        return 1;
+    }
+
+    const string packets_path (argv[1]);
+    try {
+        FlowIndexReader reader(packets_path, flow_index_path(packets_path));
+        for (int i=2; i<argc; i++) {
+            char *end;
+            unsigned long flow_id = strtoul(argv[i], &end, 10);
+            if (*argv[i] == '\0' || *end != '\0') {
+                cerr << "Warning: invalid flow id " << argv[i]
+                     << ", skipping.." << endl;
+                continue;
+            }
+            vector<string> records = reader.get_flow_packets(flow_id);
+            for (auto it = records.begin(); it != records.end(); ++it) {
+                cout << *it << endl;
+            }
+        }
+    } catch (const FlowIndexException& e) {
+        cerr << "Error: " << e.what() << endl;
+        return 1;
+    }
+
+    return 0;
+}
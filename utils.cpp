@@ -4,16 +4,6 @@
 #include <unistd.h>
 #include <ctime>
 
-void timeval_sub(const struct timeval* beginning, const struct timeval *end,
-                 struct timeval* res) {
-    res->tv_sec = end->tv_sec - beginning->tv_sec;
-    res->tv_usec = end->tv_usec - beginning->tv_usec;
-    if (res->tv_usec < 0) {
-        res->tv_usec += 1000000;
-        res->tv_sec -= 1;
-    }
-}
-
 std::string get_new_filename(std::string base_name, std::string ext) {
     std::string file_name = base_name + ext;
     unsigned int counter = 1;
@@ -1,23 +1,29 @@
 #ifndef NETSEC_UTILS_H_
 #define NETSEC_UTILS_H_
 
+#include <cstdint>
 #include <string>
 #include <unistd.h>
 #include <ctime>
 
-// Convert a timeval structure to seconds (float)
-inline double timeval_to_seconds(const struct timeval *tv) {
-  return tv->tv_sec + double(tv->tv_usec)/1000000;
+// Timestamps are represented as a signed 64-bit count of nanoseconds since the
+// epoch. Being signed, the difference of two timestamps is well defined even
+// if packets are slightly out of order.
+typedef int64_t ns_time_t;
+
+const ns_time_t NS_PER_SEC = 1000000000LL;
+
+// Convert a timestamp in seconds and sub-second units to nanoseconds.
+// subsec_to_ns is the number of nanoseconds in one sub-second unit, i.e., 1000
+// if subsec is in microseconds, or 1 if it is already in nanoseconds.
+inline ns_time_t to_ns_time(time_t sec, long subsec, ns_time_t subsec_to_ns) {
+    return ns_time_t(sec) * NS_PER_SEC + ns_time_t(subsec) * subsec_to_ns;
 }
 
-// Subtracts the time value in end from the time value in end from the time
-// value in beginning, and places the difference in the timeval pointed to
-// by res. The result is normalized such that res->tv_usec has a value in the
-// range 0 to 999,999.
-//
-// This definition is taken from the timersub manpage (bsd).
-void timeval_sub(const struct timeval* beginning, const struct timeval *end,
-                 struct timeval* res);
+// Convert a nanosecond timestamp (or time difference) to seconds (float)
+inline double ns_time_to_seconds(ns_time_t t) {
+    return double(t) / NS_PER_SEC;
+}
 
 inline bool file_exists(const std::string& name) {
     return ( access ( name.c_str(), F_OK ) != -1 );